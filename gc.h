@@ -20,6 +20,7 @@ struct gc_state {
     struct list_head heap, *stage;
     struct list_head pinned, root;
     struct stack_head scope, weak_heads;
+    struct gc_prof_head *prof;
 };
 
 struct gc_head {
@@ -30,16 +31,39 @@ struct gc_head {
 struct gc_object_type {
     void (*mark)(struct gc_state *, struct gc_head *);
     void (*free)(struct gc_state *, struct gc_head *);
+    size_t size;                /* object size seen by the profiler; 0 means sizeof(struct gc_head) */
 } __attribute__((aligned(sizeof(long))));
 
 #define gc_entry(ptr, type, field) (typecheck(struct gc_head *, ptr), container_of(ptr, type, field))
 
-static inline void INIT_GC_HEAD(struct gc_state *gc, struct gc_head *head, const struct gc_object_type *type) {
+/* profiler hook, see gc_prof.h */
+
+struct gc_prof_head {
+    void (*alloc)(struct gc_state *, struct gc_head *, const struct gc_object_type *, size_t);
+    void (*sweep)(struct gc_state *);
+    void (*free)(struct gc_state *, struct gc_head *);
+};
+
+static inline void gc_link_head(struct gc_state *gc, struct gc_head *head, const struct gc_object_type *type) {
     INIT_LIST_HEAD(&head->list_head);
     head->type_mark = (unsigned long) type;
     list_add(&head->list_head, &gc->heap);
 }
 
+/* size is what the profiler charges the allocation; use this variant for variable-length objects */
+static inline void INIT_GC_HEAD_SIZED(struct gc_state *gc, struct gc_head *head, const struct gc_object_type *type, size_t size) {
+    gc_link_head(gc, head, type);
+    if (__builtin_expect(gc->prof != NULL, 0))
+        gc->prof->alloc(gc, head, type, size);
+}
+
+/* the profiler charges type->size, which only fits fixed-size objects */
+static inline void INIT_GC_HEAD(struct gc_state *gc, struct gc_head *head, const struct gc_object_type *type) {
+    gc_link_head(gc, head, type);
+    if (__builtin_expect(gc->prof != NULL, 0))
+        gc->prof->alloc(gc, head, type, type->size ? type->size : sizeof(struct gc_head));
+}
+
 static inline const struct gc_object_type *gc_type(struct gc_head *head) {
     return (const struct gc_object_type *) (head->type_mark & ~1ul);
 }
@@ -51,11 +75,54 @@ static inline void gc_mark(struct gc_state *gc, struct gc_head *head) {
     list_move_tail(&head->list_head, gc->stage);
 }
 
-static inline void gc_del(struct gc_state *gc, struct gc_head *head) {
+/* batched gc_mark for containers: slots are n pointers that are stride bytes apart (NULLs are skipped);
+   stride must be a multiple of the pointer alignment, e.g. the size of the struct holding each slot */
+
+#define GC_MARK_BATCH 16
+
+static inline void gc_mark_strided(struct gc_state *gc, struct gc_head *const *slots, size_t n, size_t stride) {
+    struct gc_head *batch[GC_MARK_BATCH];
+    const char *p = (const char *) slots;
+    while (n > 0) {
+        size_t k = 0, m = 0;
+        /* load the slots and prefetch the heads */
+        for (; n > 0 && k < GC_MARK_BATCH; n--, p += stride) {
+            struct gc_head *head = *(struct gc_head *const *) p;
+            if (head == NULL) continue;
+            __builtin_prefetch(head, 1);
+            batch[k++] = head;
+        }
+        /* test-and-set, then prefetch the list neighbours that list_move_tail will write */
+        for (size_t i = 0; i < k; i++) {
+            struct gc_head *head = batch[i];
+            if (head->type_mark & 1)
+                continue;
+            head->type_mark |= 1ul;
+            __builtin_prefetch(head->list_head.prev, 1);
+            __builtin_prefetch(head->list_head.next, 1);
+            batch[m++] = head;
+        }
+        /* enqueue */
+        for (size_t i = 0; i < m; i++)
+            list_move_tail(&batch[i]->list_head, gc->stage);
+    }
+}
+
+static inline void gc_mark_n(struct gc_state *gc, struct gc_head *const *heads, size_t n) {
+    gc_mark_strided(gc, heads, n, sizeof(*heads));
+}
+
+static inline void gc_free_head(struct gc_state *gc, struct gc_head *head) {
     list_del(&head->list_head);
     if (gc_type(head)->free) gc_type(head)->free(gc, head);
 }
 
+static inline void gc_del(struct gc_state *gc, struct gc_head *head) {
+    if (__builtin_expect(gc->prof != NULL, 0))
+        gc->prof->free(gc, head);
+    gc_free_head(gc, head);
+}
+
 /* pin & unpin */
 
 static inline void gc_pin(struct gc_state *gc, struct gc_head *head) {
@@ -132,12 +199,19 @@ static void gc_weak_head_free(struct gc_state *gc, struct gc_head *head) {
     w->type->free(gc, head);
 }
 
-static inline void INIT_GC_WEAK_HEAD(struct gc_state *gc, struct gc_weak_head *head, const struct gc_object_type *type, struct gc_head *key, struct stack_head *notify) {
-    static const struct gc_object_type weak_head_type = { gc_weak_head_mark, gc_weak_head_free };
+static inline void INIT_GC_WEAK_HEAD_SIZED(struct gc_state *gc, struct gc_weak_head *head, const struct gc_object_type *type, struct gc_head *key, struct stack_head *notify, size_t size) {
+    static const struct gc_object_type weak_head_type = { gc_weak_head_mark, gc_weak_head_free, sizeof(struct gc_weak_head) };
     head->key = key;
     head->type = type;
     head->notify = notify;
-    INIT_GC_HEAD(gc, &head->gc_head, &weak_head_type);
+    gc_link_head(gc, &head->gc_head, &weak_head_type);
+    /* charged to the user's type rather than weak_head_type */
+    if (__builtin_expect(gc->prof != NULL, 0))
+        gc->prof->alloc(gc, &head->gc_head, type, size);
+}
+
+static inline void INIT_GC_WEAK_HEAD(struct gc_state *gc, struct gc_weak_head *head, const struct gc_object_type *type, struct gc_head *key, struct stack_head *notify) {
+    INIT_GC_WEAK_HEAD_SIZED(gc, head, type, key, notify, type->size ? type->size : sizeof(struct gc_weak_head));
 }
 
 /* gc */
@@ -149,8 +223,7 @@ static void gc_run(struct gc_state *gc) {
     /* copy objects */
     struct gc_scope *scope;
     stack_for_each_entry(scope, &gc->scope, stack_head) {
-        for (struct gc_head **head = scope->pool; head != scope->top; head++)
-            gc_mark(gc, *head);
+        gc_mark_n(gc, scope->pool, scope->top - scope->pool);
     }
     struct gc_root *root;
     list_for_each_entry (root,  &gc->root, list_head) {
@@ -188,13 +261,15 @@ static void gc_run(struct gc_state *gc) {
                 stack_push(&w->stack_head, w->notify);
         }
     }
+    if (gc->prof)
+        gc->prof->sweep(gc);
     /* clean up */
     list_for_each_entry (head, &stage, list_head) {
         head->type_mark &= ~1ul;
     }
     struct gc_head *n;
     list_for_each_entry_safe (head, n, &gc->heap, list_head) {
-        gc_del(gc, head);
+        gc_free_head(gc, head);       /* the profiler already dropped these in sweep */
     }
     list_splice(&stage, &gc->heap);
 }
@@ -204,6 +279,7 @@ static inline void gc_init(struct gc_state *gc) {
     INIT_LIST_HEAD(&gc->pinned);
     INIT_LIST_HEAD(&gc->root);
     INIT_STACK_HEAD(&gc->scope);
+    gc->prof = NULL;
 }
 
 static inline void gc_destroy(struct gc_state *gc) {
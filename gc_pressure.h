@@ -0,0 +1,196 @@
+/*
+gc_pressure.h - memory-pressure-driven collection for gc.h (Linux PSI & cgroup v2)
+
+Copyright 2017 Yuichi Nishiwaki
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef GC_PRESSURE_H
+#define GC_PRESSURE_H
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+#include "gc.h"
+
+/* The monitor is never consulted by INIT_GC_HEAD. Call gc_pressure_poll from the event loop, passing
+   triggered = true when the fd returned by gc_pressure_trigger signalled POLLPRI (the kernel clears the
+   event on that first poll, so the monitor never polls the fd itself), and gc_pressure_safepoint wherever
+   a scheduled collection is convenient. PSI avg10 stays high for a while after a collection, so each
+   level acts at most once per min_interval seconds. */
+
+#define GC_PSI_MEMORY "/proc/pressure/memory"
+#define GC_CGROUP_DIR "/sys/fs/cgroup"
+
+enum gc_pressure_level {
+    GC_PRESSURE_NONE,
+    GC_PRESSURE_SOME,           /* schedule a collection */
+    GC_PRESSURE_FULL,           /* collect now and give memory back to the OS */
+};
+
+struct gc_pressure {
+    int psi_fd, trigger_fd, max_fd, current_fd, stat_fd;
+    double some_avg10, full_avg10;      /* PSI thresholds, in percent */
+    double usage_some, usage_full;      /* working set / memory.max thresholds */
+    double min_interval;                /* seconds before the same level acts again */
+    double acted[GC_PRESSURE_FULL + 1]; /* when each level last acted */
+    bool scheduled;
+};
+
+static inline int gc_pressure_open(const char *dir, const char *name) {
+    char path[4096];
+    if (snprintf(path, sizeof(path), "%s/%s", dir, name) >= (int) sizeof(path))
+        return -1;
+    return open(path, O_RDONLY | O_CLOEXEC);
+}
+
+/* NULL selects GC_PSI_MEMORY / GC_CGROUP_DIR and "" disables the corresponding source */
+static inline void gc_pressure_init(struct gc_pressure *p, const char *psi_path, const char *cgroup_dir) {
+    psi_path = psi_path ? psi_path : GC_PSI_MEMORY;
+    cgroup_dir = cgroup_dir ? cgroup_dir : GC_CGROUP_DIR;
+    p->psi_fd = *psi_path ? open(psi_path, O_RDONLY | O_CLOEXEC) : -1;
+    p->trigger_fd = -1;
+    p->max_fd = *cgroup_dir ? gc_pressure_open(cgroup_dir, "memory.max") : -1;
+    p->current_fd = *cgroup_dir ? gc_pressure_open(cgroup_dir, "memory.current") : -1;
+    p->stat_fd = *cgroup_dir ? gc_pressure_open(cgroup_dir, "memory.stat") : -1;
+    p->some_avg10 = 10.0;
+    p->full_avg10 = 5.0;
+    p->usage_some = 0.80;
+    p->usage_full = 0.95;
+    p->min_interval = 10.0;
+    for (int i = 0; i <= GC_PRESSURE_FULL; i++)
+        p->acted[i] = -1e9;
+    p->scheduled = false;
+}
+
+static inline void gc_pressure_destroy(struct gc_pressure *p) {
+    int *fds[] = { &p->psi_fd, &p->trigger_fd, &p->max_fd, &p->current_fd, &p->stat_fd };
+    for (size_t i = 0; i < sizeof(fds) / sizeof(fds[0]); i++) {
+        if (*fds[i] >= 0) close(*fds[i]);
+        *fds[i] = -1;
+    }
+}
+
+/* registers a kernel PSI trigger such as "some 150000 1000000" and returns an fd that signals POLLPRI,
+   or -1; psi_path may be NULL for GC_PSI_MEMORY */
+static inline int gc_pressure_trigger(struct gc_pressure *p, const char *psi_path, const char *trigger) {
+    int fd = open(psi_path ? psi_path : GC_PSI_MEMORY, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    if (write(fd, trigger, strlen(trigger) + 1) < 0) {
+        close(fd);
+        return -1;
+    }
+    if (p->trigger_fd >= 0) close(p->trigger_fd);
+    return p->trigger_fd = fd;
+}
+
+static inline ssize_t gc_pressure_read(int fd, char *buf, size_t size) {
+    ssize_t n = pread(fd, buf, size - 1, 0);
+    buf[n > 0 ? n : 0] = '\0';
+    return n;
+}
+
+/* parses the avg10 of the "some" and "full" lines; missing values are left untouched */
+static inline void gc_pressure_read_psi(struct gc_pressure *p, double *some, double *full) {
+    char buf[256], *line = buf;
+    if (p->psi_fd < 0 || gc_pressure_read(p->psi_fd, buf, sizeof(buf)) <= 0)
+        return;
+    for (; line; line = strchr(line, '\n') ? strchr(line, '\n') + 1 : NULL) {
+        double avg10;
+        if (sscanf(line, "some avg10=%lf", &avg10) == 1) *some = avg10;
+        if (sscanf(line, "full avg10=%lf", &avg10) == 1) *full = avg10;
+    }
+}
+
+/* inactive_file of memory.stat, i.e. page cache the kernel can reclaim cheaply, or 0 */
+static inline unsigned long long gc_pressure_read_inactive_file(struct gc_pressure *p) {
+    char buf[4096], *line = buf;
+    unsigned long long inactive_file = 0;
+    if (p->stat_fd < 0 || gc_pressure_read(p->stat_fd, buf, sizeof(buf)) <= 0)
+        return 0;
+    for (; line; line = strchr(line, '\n') ? strchr(line, '\n') + 1 : NULL) {
+        if (sscanf(line, "inactive_file %llu", &inactive_file) == 1)
+            break;
+    }
+    return inactive_file;
+}
+
+/* working set (memory.current - inactive_file) / memory.max, or 0 when there is no limit */
+static inline double gc_pressure_read_usage(struct gc_pressure *p) {
+    char buf[64];
+    unsigned long long max, current, inactive_file;
+    if (p->max_fd < 0 || p->current_fd < 0)
+        return 0;
+    if (gc_pressure_read(p->max_fd, buf, sizeof(buf)) <= 0 || sscanf(buf, "%llu", &max) != 1 || max == 0)
+        return 0;               /* "max" */
+    if (gc_pressure_read(p->current_fd, buf, sizeof(buf)) <= 0 || sscanf(buf, "%llu", &current) != 1)
+        return 0;
+    inactive_file = gc_pressure_read_inactive_file(p);
+    return (double) (current > inactive_file ? current - inactive_file : 0) / max;
+}
+
+static inline enum gc_pressure_level gc_pressure_level(struct gc_pressure *p, bool triggered) {
+    double some = 0, full = 0, usage = gc_pressure_read_usage(p);
+    gc_pressure_read_psi(p, &some, &full);
+    if (full >= p->full_avg10 || usage >= p->usage_full)
+        return GC_PRESSURE_FULL;
+    if (triggered || some >= p->some_avg10 || usage >= p->usage_some)
+        return GC_PRESSURE_SOME;
+    return GC_PRESSURE_NONE;
+}
+
+static inline void gc_pressure_release(void) {
+#ifdef __GLIBC__
+    malloc_trim(0);
+#endif
+}
+
+static inline double gc_pressure_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* samples the sources and escalates: SOME schedules a collection, FULL runs one immediately */
+static inline enum gc_pressure_level gc_pressure_poll(struct gc_state *gc, struct gc_pressure *p, bool triggered) {
+    enum gc_pressure_level level = gc_pressure_level(p, triggered);
+    double now = gc_pressure_now();
+    if (level == GC_PRESSURE_NONE || now - p->acted[level] < p->min_interval)
+        return level;
+    p->acted[level] = now;
+    switch (level) {
+    case GC_PRESSURE_FULL:
+        p->acted[GC_PRESSURE_SOME] = now;     /* a full collection covers SOME as well */
+        p->scheduled = false;
+        gc_run(gc);
+        gc_pressure_release();
+        break;
+    case GC_PRESSURE_SOME:
+        p->scheduled = true;
+        break;
+    case GC_PRESSURE_NONE:
+        break;
+    }
+    return level;
+}
+
+static inline bool gc_pressure_safepoint(struct gc_state *gc, struct gc_pressure *p) {
+    if (! p->scheduled)
+        return false;
+    p->scheduled = false;
+    gc_run(gc);
+    return true;
+}
+
+#endif
@@ -0,0 +1,131 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "gc_pressure.h"
+
+struct gc_state gc;
+int freed;
+
+struct cell {
+    int value;
+    struct gc_head gc_head;
+};
+
+void cell_free(struct gc_state *gc, struct gc_head *head) {
+    struct cell *cell = gc_entry(head, struct cell, gc_head);
+    (void) gc;
+    printf("free %d!\n", cell->value);
+    free(cell);
+    freed++;
+}
+
+const struct gc_object_type cell_type = { NULL, cell_free, sizeof(struct cell) };
+
+void cell(int value) {
+    struct cell *cell = malloc(sizeof(struct cell));
+    cell->value = value;
+    INIT_GC_HEAD(&gc, &cell->gc_head, &cell_type);
+}
+
+void put(const char *dir, const char *name, const char *content) {
+    char path[256];
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    FILE *f = fopen(path, "w");
+    fputs(content, f);
+    fclose(f);
+}
+
+void rm(const char *dir, const char *name) {
+    char path[256];
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    unlink(path);
+}
+
+int main() {
+    char dir[] = "/tmp/gc_pressure_XXXXXX", psi[64];
+    struct gc_pressure p;
+
+    enum gc_pressure_level level;
+    bool ran;
+
+    if (mkdtemp(dir) == NULL)
+        return 1;
+    snprintf(psi, sizeof(psi), "%s/memory.pressure", dir);
+    put(dir, "memory.pressure", "some avg10=0.00 avg60=0.00 avg300=0.00 total=0\nfull avg10=0.00 avg60=0.00 avg300=0.00 total=0\n");
+    put(dir, "memory.max", "max\n");
+    put(dir, "memory.current", "1048576\n");
+    put(dir, "memory.stat", "anon 524288\nfile 524288\ninactive_file 0\nactive_file 524288\n");
+
+    gc_init(&gc);
+    gc_pressure_init(&p, psi, dir);
+
+    cell(1);
+    level = gc_pressure_poll(&gc, &p, false);
+    ran = gc_pressure_safepoint(&gc, &p);
+    assert(level == GC_PRESSURE_NONE && ! ran && freed == 0);
+
+    /* a PSI trigger event reported by the caller schedules a collection */
+    level = gc_pressure_poll(&gc, &p, true);
+    assert(level == GC_PRESSURE_SOME && freed == 0);
+    ran = gc_pressure_safepoint(&gc, &p);
+    assert(ran && freed == 1);
+
+    /* avg10 is still high right after the collection: nothing more to do */
+    put(dir, "memory.pressure", "some avg10=25.00 avg60=3.00 avg300=1.00 total=1234\nfull avg10=1.00 avg60=0.00 avg300=0.00 total=12\n");
+    level = gc_pressure_poll(&gc, &p, false);
+    ran = gc_pressure_safepoint(&gc, &p);
+    assert(level == GC_PRESSURE_SOME && ! ran);
+
+    /* FULL collects immediately */
+    cell(2);
+    put(dir, "memory.pressure", "some avg10=60.00 avg60=30.00 avg300=10.00 total=5678\nfull avg10=40.00 avg60=20.00 avg300=5.00 total=910\n");
+    level = gc_pressure_poll(&gc, &p, false);
+    assert(level == GC_PRESSURE_FULL && freed == 2);
+    ran = gc_pressure_safepoint(&gc, &p);
+    assert(! ran);
+
+    /* flapping between SOME and FULL does nothing until min_interval has passed */
+    cell(3);
+    for (int i = 0; i < 3; i++) {
+        put(dir, "memory.pressure", "some avg10=25.00 avg60=3.00 avg300=1.00 total=1234\nfull avg10=4.00 avg60=0.00 avg300=0.00 total=12\n");
+        level = gc_pressure_poll(&gc, &p, false);
+        ran = gc_pressure_safepoint(&gc, &p);
+        assert(level == GC_PRESSURE_SOME && ! ran);
+        put(dir, "memory.pressure", "some avg10=25.00 avg60=3.00 avg300=1.00 total=1234\nfull avg10=6.00 avg60=0.00 avg300=0.00 total=12\n");
+        level = gc_pressure_poll(&gc, &p, false);
+        assert(level == GC_PRESSURE_FULL && freed == 2);
+    }
+    p.min_interval = 0;
+    level = gc_pressure_poll(&gc, &p, false);
+    assert(level == GC_PRESSURE_FULL && freed == 3);
+
+    /* cgroup usage counts the working set: reclaimable page cache is not pressure */
+    put(dir, "memory.pressure", "some avg10=0.00 avg60=0.00 avg300=0.00 total=0\nfull avg10=0.00 avg60=0.00 avg300=0.00 total=0\n");
+    put(dir, "memory.max", "2097152\n");
+    put(dir, "memory.current", "2044723\n");
+    put(dir, "memory.stat", "anon 996147\nfile 1048576\ninactive_file 1048576\nactive_file 0\n");
+    level = gc_pressure_poll(&gc, &p, false);
+    assert(level == GC_PRESSURE_NONE);
+    put(dir, "memory.stat", "anon 1844723\nfile 200000\ninactive_file 200000\nactive_file 0\n");
+    level = gc_pressure_poll(&gc, &p, false);
+    assert(level == GC_PRESSURE_SOME && p.scheduled);
+    put(dir, "memory.stat", "anon 2044723\nfile 0\ninactive_file 0\nactive_file 0\n");
+    cell(4);
+    level = gc_pressure_poll(&gc, &p, false);
+    assert(level == GC_PRESSURE_FULL && freed == 4 && ! p.scheduled);
+
+    gc_pressure_destroy(&p);
+
+    /* "" disables a source */
+    gc_pressure_init(&p, "", "");
+    assert(p.psi_fd < 0 && p.max_fd < 0 && p.current_fd < 0 && p.stat_fd < 0);
+    gc_pressure_destroy(&p);
+    (void) level, (void) ran;
+    gc_destroy(&gc);
+
+    rm(dir, "memory.pressure");
+    rm(dir, "memory.max");
+    rm(dir, "memory.current");
+    rm(dir, "memory.stat");
+    rmdir(dir);
+}
@@ -0,0 +1,280 @@
+/*
+gc_prof.h - sampling allocation profiler for gc.h
+
+Copyright 2017 Yuichi Nishiwaki
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef GC_PROF_H
+#define GC_PROF_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <execinfo.h>
+#include "gc.h"
+
+/* Allocations are sampled in proportion to their size: the number of bytes between two samples is
+   exponentially distributed with mean prof->rate. A sampled object is charged to its call site
+   (backtrace + type), and every gc_run counts the sampled objects that survive it. */
+
+#define GC_PROF_DEPTH 16
+#define GC_PROF_DEFAULT_RATE (512 * 1024)
+
+struct gc_prof_site {
+    struct stack_head stack_head;
+    const struct gc_object_type *type;
+    void *pcs[GC_PROF_DEPTH];
+    int depth;
+    unsigned long samples, bytes, live, live_bytes, survivals;
+};
+
+struct gc_prof_sample {
+    struct stack_head stack_head;
+    struct gc_head *head;
+    struct gc_prof_site *site;
+    size_t size;
+};
+
+struct gc_prof {
+    struct gc_prof_head prof_head;
+    long rate, countdown;
+    unsigned long seed;
+    struct stack_head sites, samples;
+};
+
+#define gc_prof_entry(ptr) container_of(ptr, struct gc_prof, prof_head)
+
+static inline long gc_prof_next_interval(struct gc_prof *prof) {
+    /* xorshift64, then -log(u) * rate without libm: u = m * 2^e with m in [1, 2) */
+    prof->seed ^= prof->seed << 13;
+    prof->seed ^= prof->seed >> 7;
+    prof->seed ^= prof->seed << 17;
+    union { double d; unsigned long long u; } x = { .d = 1.0 - (prof->seed >> 11) * 0x1p-53 };
+    int e = (int) ((x.u >> 52) & 0x7ff) - 1023;
+    x.u = (x.u & 0x000fffffffffffffull) | 0x3ff0000000000000ull;
+    double t = (x.d - 1.0) / (x.d + 1.0), t2 = t * t;
+    double ln = e * 0.6931471805599453 + 2.0 * t * (1.0 + t2 * (1.0 / 3 + t2 * (1.0 / 5 + t2 / 7)));
+    return (long) (-ln * prof->rate) + 1;
+}
+
+static inline struct gc_prof_site *gc_prof_site(struct gc_prof *prof, const struct gc_object_type *type, void **pcs, int depth) {
+    struct gc_prof_site *site;
+    stack_for_each_entry (site, &prof->sites, stack_head) {
+        if (site->type == type && site->depth == depth && memcmp(site->pcs, pcs, depth * sizeof(void *)) == 0)
+            return site;
+    }
+    if ((site = calloc(1, sizeof(*site))) == NULL)
+        return NULL;
+    site->type = type;
+    site->depth = depth;
+    memcpy(site->pcs, pcs, depth * sizeof(void *));
+    stack_push(&site->stack_head, &prof->sites);
+    return site;
+}
+
+static void gc_prof_alloc(struct gc_state *gc, struct gc_head *head, const struct gc_object_type *type, size_t size) {
+    struct gc_prof *prof = gc_prof_entry(gc->prof);
+    if ((prof->countdown -= (long) size) > 0)
+        return;
+    prof->countdown = gc_prof_next_interval(prof);
+    void *pcs[GC_PROF_DEPTH + 1];
+    int depth = backtrace(pcs, GC_PROF_DEPTH + 1) - 1;  /* drop gc_prof_alloc itself */
+    struct gc_prof_site *site = gc_prof_site(prof, type, pcs + 1, depth > 0 ? depth : 0);
+    struct gc_prof_sample *sample;
+    if (site == NULL || (sample = malloc(sizeof(*sample))) == NULL)
+        return;
+    site->samples++;
+    site->bytes += size;
+    site->live++;
+    site->live_bytes += size;
+    sample->head = head;
+    sample->site = site;
+    sample->size = size;
+    stack_push(&sample->stack_head, &prof->samples);
+}
+
+/* called by gc_run between marking and sweeping: marked samples survive, the rest are about to be freed */
+static void gc_prof_sweep(struct gc_state *gc) {
+    struct gc_prof *prof = gc_prof_entry(gc->prof);
+    STACK_HEAD(samples);
+    stack_move_init(&prof->samples, &samples);
+    struct gc_prof_sample *sample, *n;
+    stack_for_each_entry_safe (sample, n, &samples, stack_head) {
+        if (sample->head->type_mark & 1ul) {
+            sample->site->survivals++;
+            stack_push(&sample->stack_head, &prof->samples);
+        } else {
+            sample->site->live--;
+            sample->site->live_bytes -= sample->size;
+            free(sample);
+        }
+    }
+}
+
+/* gc_del frees an object outside gc_run */
+static void gc_prof_free(struct gc_state *gc, struct gc_head *head) {
+    struct gc_prof *prof = gc_prof_entry(gc->prof);
+    struct stack_head *p;
+    stack_for_each_stack (p, &prof->samples) {
+        struct gc_prof_sample *sample = stack_entry(p->next, struct gc_prof_sample, stack_head);
+        if (sample->head == head) {
+            sample->site->live--;
+            sample->site->live_bytes -= sample->size;
+            p->next = sample->stack_head.next;
+            free(sample);
+            return;
+        }
+    }
+}
+
+static inline void gc_prof_init(struct gc_prof *prof, long rate, unsigned long seed) {
+    prof->prof_head.alloc = gc_prof_alloc;
+    prof->prof_head.sweep = gc_prof_sweep;
+    prof->prof_head.free = gc_prof_free;
+    prof->rate = rate > 0 ? rate : GC_PROF_DEFAULT_RATE;
+    prof->seed = seed ? seed : 0x9e3779b97f4a7c15ul;
+    prof->countdown = gc_prof_next_interval(prof);
+    INIT_STACK_HEAD(&prof->sites);
+    INIT_STACK_HEAD(&prof->samples);
+}
+
+/* untracked samples can no longer be followed, so the live counters restart from zero */
+static inline void gc_prof_stop(struct gc_state *gc) {
+    if (gc->prof == NULL)
+        return;
+    struct gc_prof *prof = gc_prof_entry(gc->prof);
+    gc->prof = NULL;
+    struct gc_prof_sample *sample, *ns;
+    stack_for_each_entry_safe (sample, ns, &prof->samples, stack_head) {
+        free(sample);
+    }
+    INIT_STACK_HEAD(&prof->samples);
+    struct gc_prof_site *site;
+    stack_for_each_entry (site, &prof->sites, stack_head) {
+        site->live = site->live_bytes = 0;
+    }
+}
+
+/* sites accumulate across start/stop pairs until gc_prof_destroy; a profiler already attached is stopped */
+static inline void gc_prof_start(struct gc_state *gc, struct gc_prof *prof) {
+    gc_prof_stop(gc);
+    gc->prof = &prof->prof_head;
+}
+
+static inline void gc_prof_destroy(struct gc_prof *prof) {
+    struct gc_prof_site *site, *n;
+    stack_for_each_entry_safe (site, n, &prof->sites, stack_head) {
+        free(site);
+    }
+    INIT_STACK_HEAD(&prof->sites);
+}
+
+/* report */
+
+static inline void gc_prof_copy_maps(FILE *out) {
+    FILE *maps = fopen("/proc/self/maps", "r");
+    char buf[4096];
+    size_t n;
+    if (maps == NULL)
+        return;
+    while ((n = fread(buf, 1, sizeof(buf), maps)) > 0)
+        fwrite(buf, 1, n, out);
+    fclose(maps);
+}
+
+struct gc_prof_map {
+    unsigned long start, end, base;
+    char path[256];
+};
+
+/* file-backed mappings of /proc/self/maps; base is subtracted from runtime addresses to get link-time ones */
+static inline size_t gc_prof_read_maps(struct gc_prof_map **maps) {
+    FILE *in = fopen("/proc/self/maps", "r");
+    char line[4096], perms[8];
+    size_t n = 0, cap = 0;
+    unsigned long start, end, offset, base = 0;
+    *maps = NULL;
+    if (in == NULL)
+        return 0;
+    while (fgets(line, sizeof(line), in)) {
+        struct gc_prof_map map;
+        map.path[0] = '\0';
+        if (sscanf(line, "%lx-%lx %7s %lx %*s %*s %255s", &start, &end, perms, &offset, map.path) < 5 || map.path[0] != '/')
+            continue;
+        if (offset == 0 && perms[0] == 'r') {
+            /* the ELF header is mapped here: position-independent objects (ET_DYN) are relocated by start */
+            const unsigned char *ehdr = (const unsigned char *) start;
+            base = memcmp(ehdr, "\177ELF", 4) == 0 && *(const unsigned short *) (ehdr + 16) == 3 ? start : 0;
+        }
+        if (n == cap) {
+            struct gc_prof_map *p = realloc(*maps, (cap = cap ? cap * 2 : 64) * sizeof(**maps));
+            if (p == NULL)
+                break;
+            *maps = p;
+        }
+        map.start = start;
+        map.end = end;
+        map.base = base;
+        (*maps)[n++] = map;
+    }
+    fclose(in);
+    return n;
+}
+
+/* prints addr as module+link-time address, which survives ASLR: resolve code with addr2line -e module and
+   types (data objects) with nm module */
+static inline void gc_prof_print_addr(FILE *out, const void *addr, const struct gc_prof_map *maps, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        if (maps[i].start <= (unsigned long) addr && (unsigned long) addr < maps[i].end) {
+            fprintf(out, " %s+0x%lx", maps[i].path, (unsigned long) addr - maps[i].base);
+            return;
+        }
+    }
+    fprintf(out, " %p", addr);
+}
+
+/* one line per call site: samples bytes live live-bytes survivals type @ frame... */
+static inline void gc_prof_report(struct gc_prof *prof, FILE *out) {
+    struct gc_prof_map *maps;
+    size_t n = gc_prof_read_maps(&maps);
+    fprintf(out, "gc_prof: rate=%ld\n", prof->rate);
+    struct gc_prof_site *site;
+    stack_for_each_entry (site, &prof->sites, stack_head) {
+        fprintf(out, "%lu %lu %lu %lu %lu", site->samples, site->bytes, site->live, site->live_bytes, site->survivals);
+        gc_prof_print_addr(out, site->type, maps, n);
+        fputs(" @", out);
+        for (int i = 0; i < site->depth; i++)
+            gc_prof_print_addr(out, site->pcs[i], maps, n);
+        fputc('\n', out);
+    }
+    free(maps);
+}
+
+/* legacy pprof heap profile (heap_v2) followed by the load map, readable by `pprof <binary> <file>` */
+static inline void gc_prof_report_pprof(struct gc_prof *prof, FILE *out) {
+    unsigned long live = 0, live_bytes = 0, samples = 0, bytes = 0;
+    struct gc_prof_site *site;
+    stack_for_each_entry (site, &prof->sites, stack_head) {
+        live += site->live;
+        live_bytes += site->live_bytes;
+        samples += site->samples;
+        bytes += site->bytes;
+    }
+    fprintf(out, "heap profile: %lu: %lu [%lu: %lu] @ heap_v2/%ld\n", live, live_bytes, samples, bytes, prof->rate);
+    stack_for_each_entry (site, &prof->sites, stack_head) {
+        fprintf(out, " %lu: %lu [%lu: %lu] @", site->live, site->live_bytes, site->samples, site->bytes);
+        for (int i = 0; i < site->depth; i++)
+            fprintf(out, " %p", site->pcs[i]);
+        fputc('\n', out);
+    }
+    fputs("\nMAPPED_LIBRARIES:\n", out);
+    gc_prof_copy_maps(out);
+}
+
+#endif
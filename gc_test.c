@@ -1,8 +1,10 @@
 // from picogc by Kazuho
 
+#include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include "gc.h"
+#include "gc_prof.h"
 
 struct gc_state gc;
 
@@ -25,7 +27,7 @@ void list_free(struct gc_state *gc, struct gc_head *head) {
     free(list);
 }
 
-const struct gc_object_type list_type = { list_mark, list_free };
+const struct gc_object_type list_type = { list_mark, list_free, sizeof(struct list) };
 
 struct list *cons(int value, struct list *next) {
     struct list *list = malloc(sizeof(struct list));
@@ -36,6 +38,71 @@ struct list *cons(int value, struct list *next) {
     return list;
 }
 
+struct vector {
+    size_t size;
+    struct gc_head **items;
+    struct gc_head gc_head;
+};
+
+void vector_mark(struct gc_state *gc, struct gc_head *head) {
+    struct vector *vector = gc_entry(head, struct vector, gc_head);
+    gc_mark_n(gc, vector->items, vector->size);
+}
+
+void vector_free(struct gc_state *gc, struct gc_head *head) {
+    struct vector *vector = gc_entry(head, struct vector, gc_head);
+    (void) gc;
+    printf("free vector of %zu!\n", vector->size);
+    free(vector->items);
+    free(vector);
+}
+
+const struct gc_object_type vector_type = { vector_mark, vector_free, sizeof(struct vector) };
+
+struct vector *make_vector(size_t size) {
+    struct vector *vector = malloc(sizeof(struct vector));
+    vector->size = size;
+    vector->items = calloc(size, sizeof(struct gc_head *));
+    INIT_GC_HEAD_SIZED(&gc, &vector->gc_head, &vector_type, sizeof(struct vector) + size * sizeof(struct gc_head *));
+    gc_protect(&gc, &vector->gc_head);
+    return vector;
+}
+
+struct entry {
+    unsigned long hash;
+    struct gc_head *key;
+};
+
+struct table {
+    size_t size;
+    struct entry *entries;
+    struct gc_head gc_head;
+};
+
+void table_mark(struct gc_state *gc, struct gc_head *head) {
+    struct table *table = gc_entry(head, struct table, gc_head);
+    gc_mark_strided(gc, &table->entries[0].key, table->size, sizeof(struct entry));
+}
+
+void table_free(struct gc_state *gc, struct gc_head *head) {
+    struct table *table = gc_entry(head, struct table, gc_head);
+    (void) gc;
+    printf("free table of %zu!\n", table->size);
+    free(table->entries);
+    free(table);
+}
+
+const struct gc_object_type table_type = { table_mark, table_free, sizeof(struct table) };
+
+struct table *make_table(size_t size) {
+    struct table *table = malloc(sizeof(struct table));
+    table->size = size;
+    table->entries = calloc(size, sizeof(struct entry));
+    INIT_GC_HEAD_SIZED(&gc, &table->gc_head, &table_type, sizeof(struct table) + size * sizeof(struct entry));
+    gc_protect(&gc, &table->gc_head);
+    return table;
+}
+
 struct list *e;
 
 struct list *doit(void) {
@@ -63,6 +130,7 @@ struct list *doit(void) {
 int main() {
     struct gc_head *pool[1];
     struct gc_scope scope;
+    struct gc_prof prof;
 
     gc_init(&gc);
 
@@ -88,5 +156,116 @@ int main() {
     gc_run(&gc);
     puts("1 object must be released");
 
+    struct gc_head *vpool[1];
+    gc_push_scope(&gc, &scope, vpool);
+    {
+        struct vector *v = make_vector(40);
+        struct gc_head *ipool[2];
+        struct gc_scope s;
+
+        gc_push_scope(&gc, &s, ipool);
+        v->items[0] = &cons(6, NULL)->gc_head;
+        v->items[20] = &cons(7, NULL)->gc_head;
+        v->items[39] = v->items[0];
+        gc_pop_scope(&gc);
+
+        gc_run(&gc);
+        puts("0 objects must be released");
+
+        v->items[20] = NULL;
+
+        gc_run(&gc);
+        puts("1 object must be released");
+    }
+    gc_pop_scope(&gc);
+
+    gc_run(&gc);
+    puts("2 objects must be released");
+
+    /* a strided range crossing a GC_MARK_BATCH boundary, with NULL and duplicate slots */
+    struct gc_head *tpool[1];
+    gc_push_scope(&gc, &scope, tpool);
+    {
+        struct table *t = make_table(GC_MARK_BATCH + 4);
+        struct gc_head *ipool[2];
+        struct gc_scope s;
+
+        gc_push_scope(&gc, &s, ipool);
+        t->entries[1].key = &cons(8, NULL)->gc_head;
+        t->entries[5].key = &cons(9, NULL)->gc_head;
+        t->entries[GC_MARK_BATCH + 2].key = t->entries[1].key;
+        gc_pop_scope(&gc);
+
+        gc_run(&gc);
+        puts("0 objects must be released");
+
+        t->entries[5].key = NULL;
+
+        gc_run(&gc);
+        puts("1 object must be released");
+
+        t->entries[1].key = NULL;
+
+        gc_run(&gc);
+        puts("0 objects must be released");
+    }
+    gc_pop_scope(&gc);
+
+    gc_run(&gc);
+    puts("2 objects must be released");
+
+    /* with rate 1 every list is sampled */
+    struct gc_head *lpool[3];
+    gc_prof_stop(&gc);
+    gc_prof_init(&prof, 1, 0);
+    gc_prof_start(&gc, &prof);
+    gc_prof_start(&gc, &prof);
+    gc_push_scope(&gc, &scope, lpool);
+    {
+        struct list *l = NULL;
+        for (int i = 0; i < 3; i++)
+            l = cons(10 + i, l);
+
+        gc_run(&gc);
+        gc_run(&gc);
+        puts("0 objects must be released");
+
+        struct list *x = malloc(sizeof(struct list));
+        x->value = 13;
+        x->next = NULL;
+        INIT_GC_HEAD(&gc, &x->gc_head, &list_type);
+        gc_del(&gc, &x->gc_head);
+        puts("1 object must be released");
+    }
+    gc_pop_scope(&gc);
+
+    gc_run(&gc);
+    puts("3 objects must be released");
+
+    unsigned long sites = 0, samples = 0, bytes = 0, live = 0, survivals = 0;
+    struct gc_prof_site *site;
+    stack_for_each_entry (site, &prof.sites, stack_head) {
+        assert(site->type == &list_type);
+        sites++;
+        samples += site->samples;
+        bytes += site->bytes;
+        live += site->live + site->live_bytes;
+        survivals += site->survivals;
+    }
+    assert(samples == 4 && bytes == 4 * sizeof(struct list));
+    assert(survivals == 6 && live == 0);
+
+    /* a header line and one line per site */
+    FILE *report = tmpfile();
+    unsigned long lines = 0;
+    gc_prof_report(&prof, report);
+    rewind(report);
+    for (int c; (c = fgetc(report)) != EOF; )
+        lines += c == '\n';
+    fclose(report);
+    assert(lines == sites + 1);
+    gc_prof_stop(&gc);
+    gc_prof_destroy(&prof);
+
     gc_destroy(&gc);
 }